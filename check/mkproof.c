@@ -0,0 +1,97 @@
+/*
+ * Write a synthetic mprime proof file for a small Fermat number, for the cofact -cpr and -upr regression checks.
+ *
+ * Only the parts of the proof file that cofact reads are meaningful: the header and the Suyama A residue
+ * A = 3^(F-1) mod F, calculated here with GMP. The remaining proof residues are filled with a fixed pattern,
+ * so that a wrong seek in cofact reads the pattern and is reported as a residue mismatch.
+ *
+ * Usage: mkproof [-c] n power file
+ *   -c     Corrupt the A residue by flipping its lowest bit, to check that cofact -cpr reports the mismatch
+ *   n      N of the Fermat number, 3 through 20
+ *   power  Proof power: "#" puts A first, "#x2" puts A after the first proof's # + 1 residues
+ *   file   Name of the proof file to write
+ *
+ * This program is (C) 2023-2024 Gostin and Cowie under the GPL version 3 licence, as for cofact.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <gmp.h>
+
+// Write res_len filler bytes for one unused proof residue
+void write_filler (FILE *fp, int res_len) {
+    int i;
+
+    for (i = 0; i < res_len; i++) fputc (0xA5, fp);
+}
+
+int main (int argc, char **argv) {
+    int n;				// N of the Fermat number
+    int corrupt;			// Flag to flip the lowest bit of A
+    int proof_power, proof_power_mult;	// Proof power and multiplier
+    int res_len;			// The size of a proof file residue, in bytes
+    size_t count;			// Number of bytes exported from A
+    unsigned char *A_raw;		// Buffer for the raw A residue
+    FILE *fp;
+    int argi, i;
+
+    mpz_t F, Fm1, A, three;
+
+    argi = 1;
+    corrupt = 0;
+    if (argi < argc && strcmp (argv[argi], "-c") == 0) {
+	corrupt = 1;
+	argi++;
+    }
+    if (argc - argi != 3 || sscanf (argv[argi], "%d", &n) != 1 || n < 3 || n > 20) {
+	printf ("Usage: mkproof [-c] n power file\n");
+	exit (1);
+    }
+    proof_power_mult = 1;
+    if (sscanf (argv[argi+1], "%dx%d", &proof_power, &proof_power_mult) < 1 || proof_power < 5 || proof_power > 9 ||
+	(proof_power_mult != 1 && proof_power_mult != 2)) {
+	printf ("Error: proof power must be # or #x2 with 5 <= # <= 9: %s\n", argv[argi+1]);
+	exit (1);
+    }
+
+    // A = 3^(F-1) mod F
+    mpz_init (F);
+    mpz_init (Fm1);
+    mpz_init (A);
+    mpz_init_set_ui (three, 3L);
+    mpz_set_ui (Fm1, 1L);
+    mpz_mul_2exp (Fm1, Fm1, 1UL << n);
+    mpz_add_ui (F, Fm1, 1L);
+    mpz_powm (A, three, Fm1, F);
+    if (corrupt) mpz_combit (A, 0);
+
+    res_len = 1 << (n - 3);
+    if ((A_raw = calloc (res_len, sizeof (unsigned char))) == NULL) {
+	printf ("Error: Unable to allocate buffer for A residue\n");
+	exit (1);
+    }
+    mpz_export (A_raw, &count, -1, sizeof (unsigned char), 0, 0, A);
+
+    if ((fp = fopen (argv[argi+2], "wb")) == NULL) {
+	printf ("Error: Cannot create proof file: %s\n", argv[argi+2]);
+	exit (1);
+    }
+    fprintf (fp, "PRP PROOF\nVERSION=2\nHASHSIZE=64\nPOWER=%s\nNUMBER=F%d\n", argv[argi+1], n);
+
+    // cofact seeks past the first proof's residues when the power is "#x2"
+    if (proof_power_mult == 2) {
+	for (i = 0; i < proof_power + 1; i++) write_filler (fp, res_len);
+    }
+    fwrite (A_raw, 1, res_len, fp);
+    for (i = 0; i < proof_power; i++) write_filler (fp, res_len);
+
+    if (fclose (fp) != 0) {
+	printf ("Error: Cannot write proof file: %s\n", argv[argi+2]);
+	exit (1);
+    }
+
+    free (A_raw);
+    return 0;
+}
@@ -24,10 +24,10 @@
  * Values: F is the Fermat number (2^2^n + 1), P is the product of known factors, C is the remaining cofactor.
  * Prints Res64 and Selfridge-Hurwitz residues on each step to compare with other programs. The steps are:
  *   Pepin Fermat test:
- *	R = 3^((F-1)/2) mod F			F is prime iff R == -1 mod F
+ *	R = b^((F-1)/2) mod F			F is prime iff R == -1 mod F
  *   Suyama cofactor test:
- *	A = R^2 mod F = 3^(F-1) mod F		Prime95/mprime type 5 residue
- *	B = 2^(P-1) mod F
+ *	A = R^2 mod F = b^(F-1) mod F		Prime95/mprime type 5 residue when b = 3
+ *	B = b^(P-1) mod F
  *	R = (A - B) mod C			If R == 0 then C is a PRP else C is composite
  *	R = GCD (A-B, C)			C is a prime power iff R != 1
  *
@@ -35,6 +35,13 @@
  *   mode 1: Test a Fermat number for primality using the Pepin test. Then, if known factors are provided, use the Pepin residue to perform the Suyama PRP test on the cofactor.
  *   mode 2 (-cpr): Perform all steps in mode 1. Also compare the Suyama A residue calculated by cofact to the A residue read from the proof file generated by mprime when testing the same cofactor.
  *   mode 3 (-upr): Read the Suyama A residue for a Fermat number from the mprime proof file (assumes it is correct), then perform the Suyama PRP test on the cofactor.
+ *
+ * In any mode, -tf first trial factors the Fermat number over a range of k, since any factor of F is q = k*2^(n+2)+1.
+ * Candidates are sieved by small primes in segments, then the survivors q are tested for 2^(2^n) == -1 mod q.
+ * Factors found are added to the known factors, so are validated and used in the Suyama test like supplied factors.
+ *
+ * The base b defaults to 3. With -b, the tests are run for several bases at once: each base has its own gwnum chain
+ * and B exponentiation in its own thread, while the factors, the cofactor and the proof file residue are shared.
  */
 
 #include <stdlib.h>
@@ -46,6 +53,7 @@
 #include <sys/time.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <gmp.h>
 
 #include "gwnum.h"
@@ -54,6 +62,12 @@
 #define NAME_LEN 64		// Length of the proof filename
 #define TIME_STRING_LEN 64
 #define N_FACT 10		// Number of Fermat factors supported
+#define N_BASE 8		// Number of bases supported for the Pepin and Suyama tests
+
+#define TF_SIEVE_LIMIT (1 << 20)	// Trial factoring candidates are sieved by the odd primes below this limit
+#define TF_SEG_LEN (1 << 18)		// Number of k values per sieve segment, one byte each, so a segment stays in the L2 cache
+#define TF_BATCH 8			// Number of sieve survivors whose powmods are interleaved in one pass
+#define TF_Q_BITS 63			// Candidates q must be below 2^63 for the Montgomery squaring to not overflow
 
 #define tv_secs(tv) (tv.tv_sec + tv.tv_usec / 1000000.0)
 #define tv_msecs(tv) (tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0)
@@ -106,14 +120,553 @@ int num_digits (mpz_t num) {
     return (int) digits;
 }
 
+// Do some sanity checks on the known factors fact[first] to fact[n_fact-1]: each must be > 1, divide F, be a
+// probable prime and not duplicate an earlier factor. Exits with an error if any check fails.
+void check_factors (mpz_t *fact, int first, int n_fact, mpz_t F, int n) {
+    mpz_t Base;				// Base for PRP test of a known factor
+    mpz_t Exp;				// Exponent for PRP test of a known factor
+    mpz_t R;				// Result of PRP test of a known factor
+    mpz_t tmp;				// Temp
+    int i, j;
+
+    mpz_init (Base);
+    mpz_init (Exp);
+    mpz_init (R);
+    mpz_init (tmp);
+
+    for (i = first; i < n_fact; i++) {
+	// Check that the known factor is not <= one
+	if (mpz_cmp_ui (fact[i], 1L) <= 0) {
+	    gmp_printf ("Error: supplied factor is <= 1: %Zd\n", fact[i]);
+	    printf ("Supplied factors must be primes that divide the Fermat number and must not be duplicated in the list\n");
+	    exit (1);
+	}
+	// Check that the known factor divides the Fermat number
+	mpz_tdiv_r (tmp, F, fact[i]);		// tmp = F mod fact[i]
+	if (mpz_cmp_ui (tmp, 0L) != 0) {
+	    gmp_printf ("Error: supplied factor does not divide F%d: %Zd\n", n, fact[i]);
+	    printf ("Supplied factors must be primes that divide the Fermat number and must not be duplicated in the list\n");
+	    exit (1);
+	}
+	// Check that the known factor is a pseudo prime using Fermat's little theorem
+	mpz_set_ui (Base, 3L);
+	mpz_sub_ui (Exp, fact[i], 1L);
+	mpz_powm (R, Base, Exp, fact[i]);
+	if (mpz_cmp_ui (R, 1) != 0) {
+	    gmp_printf ("Error: supplied factor is composite: %Zd\n", fact[i]);
+	    printf ("Supplied factors must be primes that divide the Fermat number and must not be duplicated in the list\n");
+	    exit (1);
+	}
+	// Check that the known factor is not a duplicate
+	for (j = 0; j < i; j++) {
+	    if (mpz_cmp (fact[i], fact[j]) == 0) {
+		gmp_printf ("Error: supplied factor is a duplicate: %Zd\n", fact[i]);
+		printf ("Supplied factors must be primes that divide the Fermat number and must not be duplicated in the list\n");
+		exit (1);
+	    }
+	}
+    }
+
+    mpz_clear (Base);
+    mpz_clear (Exp);
+    mpz_clear (R);
+    mpz_clear (tmp);
+}
+
+// Sieve primes shared by all trial factoring threads
+typedef struct {
+    int shift;				// Any factor of F is q = k * 2^shift + 1, with shift = n + 2
+    int n_primes;			// Number of odd sieve primes
+    unsigned int *primes;		// The odd sieve primes below TF_SIEVE_LIMIT
+    unsigned int *roots;		// For each prime p, the k mod p at which p divides q
+} tf_sieve_t;
+
+// Work for one trial factoring thread: sieve and test one segment of k values
+typedef struct {
+    tf_sieve_t *sieve;
+    unsigned long k_start;		// First k of the segment
+    unsigned long k_len;		// Number of k values in the segment, at most TF_SEG_LEN
+    unsigned char *seg;			// Sieve buffer for the segment, one byte per k
+    unsigned long n_tested;		// Number of sieve survivors tested
+    int n_found;			// Number of factors found in the segment
+    int overflow;			// Flag set when the segment found more than N_FACT factors
+    unsigned long found[N_FACT];	// k of each factor found
+} tf_thread_t;
+
+// Build the sieve primes and, for each prime p, the root k = -1 / 2^shift mod p
+void tf_sieve_init (tf_sieve_t *sieve, int shift) {
+    unsigned char *composite;
+    unsigned long p, r, half;
+    int i;
+
+    sieve->shift = shift;
+    composite = calloc (TF_SIEVE_LIMIT, sizeof (unsigned char));
+    sieve->primes = malloc (TF_SIEVE_LIMIT / 2 * sizeof (unsigned int));
+    sieve->roots  = malloc (TF_SIEVE_LIMIT / 2 * sizeof (unsigned int));
+    if (composite == NULL || sieve->primes == NULL || sieve->roots == NULL) {
+	printf ("Error: Unable to allocate trial factoring sieve primes\n");
+	exit (1);
+    }
+
+    sieve->n_primes = 0;
+    for (p = 3; p < TF_SIEVE_LIMIT; p += 2) {
+	if (composite[p]) continue;
+	for (r = p * p; r < TF_SIEVE_LIMIT; r += 2 * p) composite[r] = 1;
+
+	// 1 / 2^shift mod p = ((p + 1) / 2)^shift mod p
+	half = (p + 1) / 2;
+	r = 1;
+	for (i = 0; i < shift; i++) r = (r * half) % p;
+
+	sieve->primes[sieve->n_primes] = p;
+	sieve->roots[sieve->n_primes] = p - r;
+	sieve->n_primes++;
+    }
+    free (composite);
+}
+
+void tf_sieve_done (tf_sieve_t *sieve) {
+    free (sieve->primes);
+    free (sieve->roots);
+}
+
+// Return -1 / q mod 2^64 for odd q, by Newton iteration. Each step doubles the number of correct bits, starting from 3.
+unsigned long mont_neg_inv (unsigned long q) {
+    unsigned long inv = q;
+    int i;
+
+    for (i = 0; i < 5; i++) inv *= 2 - q * inv;
+    return -inv;
+}
+
+// Montgomery squaring: return x^2 / 2^64 mod q, for q < 2^63 and x < q
+// Always inlined, despite -fno-inline, since it is the inner loop of trial factoring
+static inline __attribute__ ((always_inline)) unsigned long mont_sqr (unsigned long x, unsigned long q, unsigned long qinv) {
+    unsigned __int128 t;
+    unsigned long m;
+
+    t = (unsigned __int128) x * x;
+    m = (unsigned long) t * qinv;
+    t = (t + (unsigned __int128) m * q) >> 64;
+    return (t >= q) ? (unsigned long) t - q : (unsigned long) t;
+}
+
+// Test up to TF_BATCH candidates q = k * 2^shift + 1 for 2^(2^n) == -1 mod q, i.e. q divides F.
+// The candidates' squaring chains are independent, so they are run in lockstep to keep the multipliers busy.
+void tf_test_batch (tf_thread_t *tf, unsigned long *k, int cnt) {
+    unsigned long q[TF_BATCH], qinv[TF_BATCH], x[TF_BATCH], m1[TF_BATCH];
+    int shift = tf->sieve->shift;
+    int i, j;
+
+    for (i = 0; i < cnt; i++) {
+	q[i] = (k[i] << shift) + 1;
+	qinv[i] = mont_neg_inv (q[i]);
+	x[i] = (unsigned long) (((unsigned __int128) 2 << 64) % q[i]);		// 2 in Montgomery form
+	m1[i] = q[i] - (unsigned long) (((unsigned __int128) 1 << 64) % q[i]);	// -1 in Montgomery form
+    }
+
+    // n squarings of 2 give 2^(2^n)
+    for (j = 0; j < shift - 2; j++) {
+	for (i = 0; i < cnt; i++) x[i] = mont_sqr (x[i], q[i], qinv[i]);
+    }
+
+    for (i = 0; i < cnt; i++) {
+	if (x[i] != m1[i]) continue;
+	if (tf->n_found < N_FACT) {
+	    tf->found[tf->n_found++] = k[i];
+	} else {
+	    tf->overflow = 1;
+	}
+    }
+    tf->n_tested += cnt;
+}
+
+// Thread entry point: sieve one segment of k values, then test the survivors in batches
+void *tf_segment (void *arg) {
+    tf_thread_t *tf = (tf_thread_t *) arg;
+    tf_sieve_t *sieve = tf->sieve;
+    unsigned long batch[TF_BATCH];
+    unsigned long p, off, k_p;
+    int i, cnt;
+
+    memset (tf->seg, 1, tf->k_len);
+    for (i = 0; i < sieve->n_primes; i++) {
+	p = sieve->primes[i];
+	off = (sieve->roots[i] + p - tf->k_start % p) % p;
+
+	// Do not strike q when q is the sieve prime itself
+	if (((p - 1) & ((1UL << sieve->shift) - 1)) == 0) {
+	    k_p = (p - 1) >> sieve->shift;
+	    if (k_p == tf->k_start + off) off += p;
+	}
+	for (; off < tf->k_len; off += p) tf->seg[off] = 0;
+    }
+
+    cnt = 0;
+    for (off = 0; off < tf->k_len; off++) {
+	if (!tf->seg[off]) continue;
+	batch[cnt++] = tf->k_start + off;
+	if (cnt == TF_BATCH) {
+	    tf_test_batch (tf, batch, cnt);
+	    cnt = 0;
+	}
+    }
+    if (cnt > 0) tf_test_batch (tf, batch, cnt);
+
+    return NULL;
+}
+
+// Write the trial factoring checkpoint: the range, the next k to sieve, and the k of each factor found so far.
+// The file is written under a temporary name then renamed, so an interrupted write never loses the previous checkpoint.
+void tf_write_checkpoint (char *name, int n, unsigned long k_min, unsigned long k_max, unsigned long k_next, unsigned long *found, int n_found) {
+    char tmp_name[NAME_LEN + 8];
+    FILE *fp;
+    int i;
+
+    snprintf (tmp_name, sizeof (tmp_name), "%s.tmp", name);
+    if ((fp = fopen (tmp_name, "w")) == NULL) {
+	printf ("Error: Cannot write trial factoring checkpoint file: %s\n", tmp_name);
+	exit (1);
+    }
+    fprintf (fp, "COFACT TF CHECKPOINT\n");
+    fprintf (fp, "F=%d KMIN=%lu KMAX=%lu KNEXT=%lu\n", n, k_min, k_max, k_next);
+    for (i = 0; i < n_found; i++) fprintf (fp, "FOUND=%lu\n", found[i]);
+    if (fclose (fp) != 0 || rename (tmp_name, name) != 0) {
+	printf ("Error: Cannot write trial factoring checkpoint file: %s\n", name);
+	exit (1);
+    }
+}
+
+// Read the trial factoring checkpoint, if there is one. Returns the next k to sieve, or k_min if there is no checkpoint.
+unsigned long tf_read_checkpoint (char *name, int n, unsigned long k_min, unsigned long k_max, unsigned long *found, int *n_found) {
+    FILE *fp;
+    int n_ckp;
+    unsigned long k_min_ckp, k_max_ckp, k_next, k_found;
+
+    *n_found = 0;
+    if ((fp = fopen (name, "r")) == NULL) return k_min;
+
+    if (fscanf (fp, "COFACT TF CHECKPOINT\n") != 0 ||
+	fscanf (fp, "F=%d KMIN=%lu KMAX=%lu KNEXT=%lu\n", &n_ckp, &k_min_ckp, &k_max_ckp, &k_next) != 4) {
+	printf ("Error: Cannot parse trial factoring checkpoint file: %s\n", name);
+	exit (1);
+    }
+    if (n_ckp != n || k_min_ckp != k_min || k_max_ckp != k_max || k_next < k_min || k_next > k_max + 1) {
+	printf ("Error: Trial factoring checkpoint file %s is for F%d k = %lu to %lu, not F%d k = %lu to %lu\n",
+		name, n_ckp, k_min_ckp, k_max_ckp, n, k_min, k_max);
+	exit (1);
+    }
+    while (*n_found < N_FACT && fscanf (fp, "FOUND=%lu\n", &k_found) == 1) found[(*n_found)++] = k_found;
+    fclose (fp);
+
+    return k_next;
+}
+
+// Trial factor F = 2^2^n + 1 over k_min <= k <= k_max, looking for factors q = k * 2^(n+2) + 1.
+// Each thread sieves and tests its own segment. A checkpoint, if named, is written after each round of segments.
+// A q that divides F but is composite, i.e. a product of factors of F, is skipped, as is F itself when F is prime.
+// Returns the number of prime factors found, with their k values in found[].
+int trial_factor (int n, mpz_srcptr F, unsigned long k_min, unsigned long k_max, int threads, char *ckp_name, unsigned long *found, int verbose) {
+    tf_sieve_t sieve;
+    tf_thread_t *tf;
+    pthread_t *tid;
+    unsigned long k_next, k_progress, k_progress_inc, n_tested;
+    int n_found, t, n_run, i;
+    struct timeval tv_tf_start, tv_tf_stop;
+    float tf_time;
+    mpz_t q;				// A candidate that divides F
+
+    mpz_init (q);
+
+    (void) gettimeofday(&tv_tf_start, (struct timezone *) 0);
+
+    printf ("Trial factoring F%d with q = k*2^%d+1 for k = %lu to %lu using %d threads\n", n, n + 2, k_min, k_max, threads);
+
+    n_found = 0;
+    k_next = k_min;
+    if (ckp_name[0] != '\0') {
+	k_next = tf_read_checkpoint (ckp_name, n, k_min, k_max, found, &n_found);
+	if (k_next != k_min) printf ("Resuming from checkpoint file %s at k = %lu\n", ckp_name, k_next);
+	for (i = 0; i < n_found; i++) printf ("Factor from checkpoint: k = %lu\n", found[i]);
+    }
+    fflush (stdout);
+
+    tf_sieve_init (&sieve, n + 2);
+    if (verbose) printf ("Sieving with %d primes below %d\n", sieve.n_primes, TF_SIEVE_LIMIT);
+
+    tf  = calloc (threads, sizeof (tf_thread_t));
+    tid = calloc (threads, sizeof (pthread_t));
+    if (tf == NULL || tid == NULL) {
+	printf ("Error: Unable to allocate trial factoring threads\n");
+	exit (1);
+    }
+    for (t = 0; t < threads; t++) {
+	tf[t].sieve = &sieve;
+	if ((tf[t].seg = malloc (TF_SEG_LEN)) == NULL) {
+	    printf ("Error: Unable to allocate trial factoring sieve segment\n");
+	    exit (1);
+	}
+    }
+
+    // Print progress every 10% of the range, rounded up to a whole round of segments
+    k_progress_inc = (k_max - k_min) / 10 + 1;
+    k_progress = k_next + k_progress_inc;
+    n_tested = 0;
+
+    while (k_next <= k_max) {
+	// Start one segment per thread
+	for (n_run = 0; n_run < threads && k_next <= k_max; n_run++) {
+	    tf[n_run].k_start = k_next;
+	    tf[n_run].k_len = (k_max - k_next + 1 < TF_SEG_LEN) ? k_max - k_next + 1 : TF_SEG_LEN;
+	    tf[n_run].n_tested = 0;
+	    tf[n_run].n_found = 0;
+	    tf[n_run].overflow = 0;
+	    k_next += tf[n_run].k_len;
+	    if (pthread_create (&tid[n_run], NULL, tf_segment, &tf[n_run]) != 0) {
+		printf ("Error: Unable to create trial factoring thread\n");
+		exit (1);
+	    }
+	}
+
+	// Wait for the round to finish, then collect factors in k order
+	for (t = 0; t < n_run; t++) {
+	    pthread_join (tid[t], NULL);
+	    n_tested += tf[t].n_tested;
+	    if (tf[t].overflow) {
+		printf ("Error: trial factoring found more than %d candidates dividing F%d in one segment\n", N_FACT, n);
+		exit (1);
+	    }
+	    for (i = 0; i < tf[t].n_found; i++) {
+		mpz_set_ui (q, tf[t].found[i] << (n + 2));
+		mpz_add_ui (q, q, 1L);
+		if (mpz_cmp (q, F) == 0) continue;			// F itself when F is a small prime
+		if (!mpz_probab_prime_p (q, 25)) {
+		    printf ("Skipping k = %lu: q = %lu divides F%d but is a product of smaller factors\n", tf[t].found[i], mpz_get_ui (q), n);
+		    continue;
+		}
+		if (n_found == N_FACT) {
+		    printf ("Error: cofact currently supports a maximum of %d factors; trial factoring found more\n", N_FACT);
+		    exit (1);
+		}
+		printf ("Found factor: k = %lu, q = %lu\n", tf[t].found[i], mpz_get_ui (q));
+		found[n_found++] = tf[t].found[i];
+	    }
+	}
+
+	if (ckp_name[0] != '\0') tf_write_checkpoint (ckp_name, n, k_min, k_max, k_next, found, n_found);
+
+	if (k_next >= k_progress && k_next <= k_max) {
+	    (void) gettimeofday(&tv_tf_stop, (struct timezone *) 0);
+	    tf_time = tv_secs(tv_tf_stop) - tv_secs(tv_tf_start);
+	    printf ("k: %lu / %lu (%5.1f%%), Elapsed time = %.1f sec\n", k_next - 1, k_max, 100.0 * (k_next - k_min) / (k_max - k_min + 1), tf_time);
+	    fflush (stdout);
+	    while (k_progress <= k_next) k_progress += k_progress_inc;
+	}
+    }
+
+    (void) gettimeofday(&tv_tf_stop, (struct timezone *) 0);
+    tf_time = tv_secs(tv_tf_stop) - tv_secs(tv_tf_start);
+    printf ("Trial factoring complete: %d factors found, %lu sieve survivors tested, %.1f sec\n\n", n_found, n_tested, tf_time);
+
+    for (t = 0; t < threads; t++) free (tf[t].seg);
+    free (tf);
+    free (tid);
+    tf_sieve_done (&sieve);
+    mpz_clear (q);
+
+    return n_found;
+}
+
+// One base b of the Pepin and Suyama tests. Each base runs its gwnum chain and its B exponentiation in its own thread.
+typedef struct {
+    unsigned long base;			// The base b
+    char label[32];			// Prefix for this base's output: empty for a single base, else "Base b "
+    int n;				// N of the Fermat number
+    int threads;			// Number of threads to use in this base's gwnum library chain
+    int verbose;			// Flag to enable printing more information
+    int debug;				// Flag to enable printing debug information
+    unsigned long m_progress_inc;	// The m increment at which to report progress, 0 for none
+    struct timeval *tv_start;		// Start of the run, for the progress wall time
+    mpz_srcptr F;			// The Fermat number
+    mpz_srcptr Pm1;			// The product of the known factors minus one
+    mpz_t R;				// The Pepin residue, later the final Suyama residue
+    mpz_t A;				// The A residue
+    mpz_t B;				// The B residue
+    char R_len_line[128];		// Verbose length and words of the Pepin residue, printed by main after the join
+    char A_len_line[128];		// Verbose length and words of the A residue, printed by main after the join
+} base_test_t;
+
+// Thread entry point: Pepin test R = b^((F-1)/2) mod F using the gwnum library, then one more square/mod for A = b^(F-1) mod F
+void *pepin_thread (void *arg) {
+    base_test_t *bt = (base_test_t *) arg;
+    unsigned long k;			// Always 1 for a Fermat number
+    unsigned long exp;			// The fermat exponent: 2^n
+    unsigned long x;			// Number of Pepin test square/mod operations
+    unsigned long m;			// Iteration counter for square/mod loop
+    unsigned long m_progress;		// The next m at which to print progress
+    struct timeval tv_progress_start, tv_progress_stop;
+    float wall_time, ms_per_iter;
+    int wall_hours, wall_mins, wall_secs;
+    char line[1024];			// Temp string
+
+    gwhandle gwdata;			// Structure for gwlib information
+    gwnum r_gw;				// The square/mode residue
+    int gwerr;				// Error value returned by some gwnum library calls
+    double maxerr;			// The maximum roundoff error returned by gw_get_maxerr
+    size_t r_bin_buf_len;		// Number of longs in r_bin buffer
+    unsigned long *r_bin;		// Binary array for tranfer of residue from GWNUM to GMP
+    int len;				// Temp
+
+    if (bt->verbose) printf ("%sUsing %d threads in gwnum library\n", bt->label, bt->threads);
+    fflush (stdout);
+
+    k = 1;							// K for modulo value
+    exp = 1UL << bt->n;
+
+    if (bt->debug) printf ("%sCalling gwinit (gwhandle = %p)\n", bt->label, &gwdata);
+    gwinit (&gwdata);						// Initialize the gwnum handle
+
+    if (bt->debug) printf ("%sCalling gwset_num_threads (gwhandle = %p, num_threads = %ld)\n", bt->label, &gwdata, (unsigned long) bt->threads);
+    gwset_num_threads (&gwdata, (unsigned long) bt->threads);	// Set number of threads to use
+
+    if (bt->debug) printf ("%sCalling gwset_safety_margin (gwhandle = %p, safety_margin = %lf)\n", bt->label, &gwdata, (double) 2.0);
+    gwset_safety_margin (&gwdata, (double) 2.0);		// Had to set this to 3 in pmfs to prevent calc errors with very large N
+
+    if (bt->debug) printf ("%sCalling gwsetup (gwhandle = %p, k = %lf, b = %ld, n = %ld, c = %ld)\n", bt->label, &gwdata, (double) k, 2L, exp, 1L);
+    gwerr = gwsetup (&gwdata, (double) k, 2L, exp, 1L);		// Setup to use modulo F = 2^2^n + 1
+								// Note that K is double, so only values <= 53 bits can be represented. GWNUM checks for this.
+    if (gwerr) {
+	if (gwerr == 1002) {
+	    printf ("%sgwsetup error = 1002 (Number too large for the FFTs)\n", bt->label);
+	    if (bt->n == 30) printf ("Note that gwnum requires an AVX512 computer to support F30\n");
+	} else {
+	    printf ("%sgwsetup error = %d\n", bt->label, gwerr);
+	}
+	exit (1);
+    }
+    gwsetnormroutine (&gwdata, 0, 1, 0);			// Set flag to enable round-off error checking
+								// This call must be AFTER gwsetup
+    if (bt->verbose) {
+	gwfft_description (&gwdata, line);
+	printf ("%sfft_description: %s\n", bt->label, line);
+	printf ("%sfftlen = %ld\n", bt->label, gwfftlen (&gwdata));
+	printf ("%snear_fft_limit = %d\n", bt->label, gwnear_fft_limit (&gwdata, (double)3.0));
+	printf ("\n");
+    }
+
+    r_gw = gwalloc (&gwdata);					// Allocate a GW number for the residue
+    if (r_gw == NULL) {
+	printf ("%sgwalloc for r_gw failed\n", bt->label);
+	exit (1);
+    }
+
+    // Initialize r_gw = base for Pepin test
+    binary64togw (&gwdata, &bt->base, 1L, r_gw);
+
+    gw_clear_maxerr (&gwdata);
+
+    // Create buffer for transfer of residues from GWNUM to GMP
+    r_bin_buf_len = exp / 64 + 1;
+    r_bin = (unsigned long *) calloc (r_bin_buf_len, sizeof (unsigned long));
+
+    x = exp - 1;						// Number of Pepin test square/mod steps: x = 2^n - 1
+
+    m_progress = bt->m_progress_inc;
+    (void) gettimeofday(&tv_progress_start, (struct timezone *) 0);
+
+    // Almost all the runtime is in the following loop
+    for (m = 1; m <= x; m++) {
+	if (m < 24) {						// FIXME Good for n <= 2^24? Could this be set more intelligently?
+	    gwsquare2_carefully (&gwdata, r_gw, r_gw);		// r_gw = (r_gw ^ 2) mod F
+	} else {
+	    gwsquare2 (&gwdata, r_gw, r_gw, 0);			// r_gw = (r_gw ^ 2) mod F
+	}
+
+	maxerr = gw_get_maxerr (&gwdata);
+	if (maxerr >= 0.45) {
+	    printf ("%sRoundoff warning: k = %ld, n = %d, m = %ld, maxerr = %22.20lf\n", bt->label, k, bt->n, m, maxerr);
+	    gw_clear_maxerr (&gwdata);
+	}
+
+	if (bt->m_progress_inc > 0 && m >= m_progress) {
+	    (void) gettimeofday(&tv_progress_stop, (struct timezone *) 0);
+	    wall_time = tv_secs(tv_progress_stop) - tv_secs((*bt->tv_start));
+	    wall_hours = wall_time / 3600;
+	    wall_mins = (wall_time - (wall_hours * 3600)) / 60;
+	    wall_secs = (wall_time - (wall_hours * 3600) - (wall_mins * 60));
+	    ms_per_iter = (tv_msecs(tv_progress_stop) - tv_msecs(tv_progress_start)) / bt->m_progress_inc;
+	    printf ("%sIteration: %9ld / %9ld (%5.1f%%), ms/iter: %7.3lf, Wall time = %d:%02d:%02d (HH:MM:SS)\n", bt->label, m, x, 100.0 * m / x, ms_per_iter, wall_hours, wall_mins, wall_secs);
+	    fflush (stdout);
+	    m_progress += bt->m_progress_inc;
+	    tv_progress_start.tv_sec  = tv_progress_stop.tv_sec;
+	    tv_progress_start.tv_usec = tv_progress_stop.tv_usec;
+	}
+    }
+
+    // Check for errors
+    gwerr =  gw_test_for_error (&gwdata);
+    if (gwerr) {
+	printf ("%sError: gw_test_for_error = %d\n", bt->label, gwerr);
+	exit (1);
+    }
+
+    // Convert Pepin residue r_gw to r_bin to R
+    len = gwtobinary64 (&gwdata, r_gw, r_bin, r_bin_buf_len);
+    mpz_import (bt->R, len, -1, 8, 0, 0, r_bin);
+
+    if (bt->verbose) {
+	snprintf (bt->R_len_line, sizeof (bt->R_len_line), "%sPepin residue:  len = %d, %016lx ... %016lx %016lx\n", bt->label, len, r_bin[len-1], r_bin[1], r_bin[0]);
+    }
+
+    // Square/mod one more time to get A. For base 3 this is the mprime proof file residue.
+    gwsquare2 (&gwdata, r_gw, r_gw, 0);			// r_gw = (r_gw ^ 2) mod F
+    len = gwtobinary64 (&gwdata, r_gw, r_bin, r_bin_buf_len);
+    mpz_import (bt->A, len, -1, 8, 0, 0, r_bin);
+
+    if (bt->verbose) {
+	snprintf (bt->A_len_line, sizeof (bt->A_len_line), "%sSuyama A residue: len = %d, %016lx ... %016lx %016lx\n", bt->label, len, r_bin[len-1], r_bin[1], r_bin[0]);
+    }
+
+    free (r_bin);
+    gwfree (&gwdata, r_gw);			// Free the GW number: GW docs do not make it clear when this is needed
+    gwdone (&gwdata);				// Free all GW data
+
+    return NULL;
+}
+
+// Thread entry point: Suyama B = b^(P-1) mod F
+void *suyama_b_thread (void *arg) {
+    base_test_t *bt = (base_test_t *) arg;
+    mpz_t b;
+
+    mpz_init_set_ui (b, bt->base);
+    mpz_powm (bt->B, b, bt->Pm1, bt->F);
+    mpz_clear (b);
+
+    return NULL;
+}
+
+// Print the wall time of a stage of the run, then restart the stage timer for the next stage
+void print_stage_time (char *stage, struct timeval *tv_stage) {
+    struct timeval tv_now;
+
+    (void) gettimeofday(&tv_now, (struct timezone *) 0);
+    printf ("Stage time: %s %.6f sec\n", stage, tv_secs(tv_now) - tv_secs((*tv_stage)));
+    *tv_stage = tv_now;
+}
+
 void usage () {
-    printf ("Usage: cofact [-cpr file] [-d] [-h] [-p iter] [-sep] [-t threads] [-upr file] [-v] Fermat_exponent factor_1 factor_2 ...\n");
+    printf ("Usage: cofact [-b bases] [-cpr file] [-d] [-h] [-p iter] [-sep] [-st] [-t threads] [-tf k_min k_max] [-tfc file] [-upr file] [-v] Fermat_exponent factor_1 factor_2 ...\n");
+    printf ("    -b bases     Comma separated list of bases for the Pepin and Suyama tests, e.g. 3,5,7, run concurrently. Defaults to 3.\n");
     printf ("    -cpr file    Read the Suyama A residue from the mprime proof file and compare it to the A residue calculated by cofact (mode 2)\n");
     printf ("    -d           Print debug information\n");
     printf ("    -h           Print this help and exit\n");
     printf ("    -p iter      Print progress every iter iterations, instead of the default of every 10%% of total iterations for longer runs\n");
     printf ("    -sep         Print a separator at the end of the run to better see multiple run's output in a single output file\n");
-    printf ("    -t threads   Specifies the number of threads to use in the gwnum library. Defaults to 1.\n");
+    printf ("    -st          Print the wall time of each stage of the run: tf, proof, pepin, suyama_b and suyama_r\n");
+    printf ("    -t threads   Specifies the number of threads to use in the gwnum library, split between the bases (at least one per base), and for trial factoring. Defaults to 1.\n");
+    printf ("    -tf kmin kmax Trial factor the Fermat number with q = k*2^(n+2)+1 for kmin <= k <= kmax. Factors found are added to the known factors\n");
+    printf ("    -tfc file    Save trial factoring progress to the checkpoint file, and resume from it if it exists. Requires -tf\n");
     printf ("    -upr file    Read the Suyama A residue from the mprime proof file and use it to complete the Suyama test (mode 3)\n");
     printf ("    -v           Print more verbose information\n");
     printf ("\n");
@@ -122,20 +675,28 @@ void usage () {
 int main (int argc, char **argv) {
     int n;				// N of the Fermat number
     int n_fact;				// The number of factors entered
-    unsigned long k;			// Always 1 for a Fermat number
     unsigned long exp;			// The fermat exponent: 2^n
-    unsigned long base;			// The base to test: always 3
-    unsigned long x;			// Number of Pepin test square/mod operations
-    unsigned long m;			// Iteration counter for square/mod loop
-    unsigned long m_progress;		// The next m at which to print progress
     unsigned long m_progress_inc;	// The m increment at which to report progress
     int digits;				// Number of digits in the cofactor
-    int threads;			// Number of threads (cores) to use in gwnum library
+    int threads;			// Number of threads (cores) to use in gwnum library, split between the bases
+    unsigned long bases[N_BASE];	// The bases to test
+    int n_base;				// The number of bases
+    int n_chain;			// The number of bases needing a gwnum chain for the Pepin test
+    int proof_base;			// Index in bases[] of base 3, whose A residue is in the proof file, or -1
+    char *base_s;			// Start of the current base in the -b list
+    char *base_end;			// End of the current base in the -b list
     int verbose;			// Flag to enable printing more information
     int debug;				// Flag to enable printing debug information
     int sep;				// Flag to print a separator line at the end of the run
+    int stage_times;			// Flag to print the wall time of each stage
     int check_proof_res;		// Flag to enable checking the mprime proof file A residue
     int use_proof_res;			// Flag to enable using the mprime proof file A residue instead of calculating it
+    int tf_enabled;			// Flag to enable trial factoring
+    unsigned long tf_k_min, tf_k_max;	// Range of k to trial factor
+    unsigned long tf_found[N_FACT];	// k of each factor found by trial factoring
+    int tf_n_found;			// Number of factors found by trial factoring
+    int n_supplied;			// Number of factors supplied on the command line
+    char tf_ckp_name[NAME_LEN];		// Name of the trial factoring checkpoint file, empty for none
     long fseek_rtn;			// Return value from fseek
     long ftell_rtn_0, ftell_rtn_1;	// Return value from ftell before and after fseek call
     int res_len;			// The size of the proof file residue, in bytes
@@ -143,39 +704,29 @@ int main (int argc, char **argv) {
     char line[1024];			// Temp string
     int fermat_prime;			// Flag indicating the Fermat number is prime
     int cofactor_prp;			// Flag indicating the Fermat number cofactor is a PRP
+    int fully_factored;			// Flag indicating the known factors multiply to F, so the cofactor is 1
     int argi, rtn, i, j;
 
     // Various time variables
-    static struct timeval tv_start, tv_stop, tv_progress_start, tv_progress_stop;
-    float wall_time, ms_per_iter;
+    static struct timeval tv_start, tv_stop;
+    struct timeval tv_stage;		// Start of the current stage, for -st
+    float wall_time;
     int wall_hours, wall_mins, wall_secs;
 
     time_t current_time;
     struct tm *time_block;
     char time_string[TIME_STRING_LEN];
 
-    // gwnum library variables
-    gwhandle gwdata;			// Structure for gwlib information
-    gwnum r_gw;				// The square/mode residue
-    int gwerr;				// Error value returned by some gwnum library calls
-    double maxerr;			// The maximum roundoff error returned by gw_get_maxerr
-
-    size_t r_bin_buf_len;		// Number of longs in r_bin buffer
-    unsigned long *r_bin;		// Binary array for tranfer of residue from GWNUM to GMP
-    int len;				// Temp
+    // Per base test variables
+    base_test_t bt[N_BASE];		// The Pepin and Suyama test of each base
+    pthread_t base_tid[N_BASE];		// The thread running each base's gwnum chain or B exponentiation
 
     mpz_t fact[N_FACT];			// The known factors of the Fermat number
-    mpz_t Base;				// Base for PRP test of a known factor
-    mpz_t Exp;				// Exponent for PRP test of a known factor
     mpz_t Fm1;				// The Fermat number - 1
     mpz_t F;				// The Fermat number
-    mpz_t R;				// The Pepin residue, later the final Suyama residue
-    mpz_t A;				// The A residue
-    mpz_t B;				// The B residue
     mpz_t P;				// The product of the known factors
     mpz_t Pm1;				// The product of the known factors minus one
     mpz_t C;				// The remaining cofactor
-    mpz_t three;			// The base 3
     mpz_t A_proof;			// The proof file residue
     mpz_t tmp;				// Temp
 
@@ -215,18 +766,12 @@ int main (int argc, char **argv) {
     printf ("Command line: %s\n\n", cmdline);
 
     // Initialize GMP variables
-    for (i=0; i<=N_FACT; i++) mpz_init (fact[i]);
-    mpz_init (Base);
-    mpz_init (Exp);
+    for (i=0; i<N_FACT; i++) mpz_init (fact[i]);
     mpz_init (Fm1);
     mpz_init (F);
-    mpz_init (R);
-    mpz_init (A);
-    mpz_init (B);
     mpz_init (P);
     mpz_init (Pm1);
     mpz_init (C);
-    mpz_init (three);
     mpz_init (A_proof);
     mpz_init (tmp);
 
@@ -234,20 +779,51 @@ int main (int argc, char **argv) {
     mpz_init (r64);
 
     mpz_set_ui (mask64, 0xffffffffffffffffL);
-    mpz_set_ui (three, 3L);
 
     threads = 1;		// Default to 1 thread
+    n_base = 1;			// Default to base 3 only
+    bases[0] = 3;
     verbose = 0;		// Default to no verbose
     debug = 0;			// Default to no debug
     sep = 0;			// Default to no separator line
+    stage_times = 0;		// Default to no stage times
     check_proof_res = 0;	// Default to not checking
     use_proof_res = 0;		// Default to calculating the A residue
+    tf_enabled = 0;		// Default to no trial factoring
+    tf_k_min = 0;
+    tf_k_max = 0;
+    tf_ckp_name[0] = '\0';	// Default to no trial factoring checkpoint
     m_progress_inc = 0;		// Default of 0 will be changed to 10% of the run
     n = 0;			// Invalid value, to make sure n is later set
 
     // Parse command line arguments starting with "-"
     // The following loop will exit when first non "-" argument is found
     for (argi = 1; argi < argc; argi++) {
+	if (strcmp(argv[argi], "-b") == 0) {
+	    if (argi + 1 >= argc) {
+		printf ("Error: -b requires a list of bases, e.g. -b 3,5,7\n");
+		usage ();
+		exit (1);
+	    }
+	    argi++;
+	    // Each base must be all digits and end at a comma or at the end of the list
+	    n_base = 0;
+	    base_s = argv[argi];
+	    while (1) {
+		if (n_base == N_BASE) {
+		    printf ("Error: cofact currently supports a maximum of %d bases\n", N_BASE);
+		    exit (1);
+		}
+		bases[n_base] = strtoul (base_s, &base_end, 10);
+		if (*base_s < '0' || *base_s > '9' || (*base_end != ',' && *base_end != '\0')) {
+		    printf ("Error: cannot parse base list: %s\n", argv[argi]);
+		    exit (1);
+		}
+		n_base++;
+		if (*base_end == '\0') break;
+		base_s = base_end + 1;
+	    }
+	} else
 	if (strcmp(argv[argi], "-cpr") == 0) {
 	    check_proof_res = 1;
 	    argi++;
@@ -267,10 +843,34 @@ int main (int argc, char **argv) {
 	if (strcmp(argv[argi], "-sep") == 0) {
 	    sep = 1;
 	} else
+	if (strcmp(argv[argi], "-st") == 0) {
+	    stage_times = 1;
+	} else
 	if (strcmp(argv[argi], "-t") == 0) {
 	    argi++;
 	    threads = atoi(argv[argi]);
 	} else
+	if (strcmp(argv[argi], "-tf") == 0) {
+	    if (argi + 2 >= argc) {
+		printf ("Error: -tf requires k_min and k_max\n");
+		usage ();
+		exit (1);
+	    }
+	    tf_enabled = 1;
+	    tf_k_min = strtoul(argv[argi+1], NULL, 10);
+	    tf_k_max = strtoul(argv[argi+2], NULL, 10);
+	    argi += 2;
+	} else
+	if (strcmp(argv[argi], "-tfc") == 0) {
+	    if (argi + 1 >= argc) {
+		printf ("Error: -tfc requires a checkpoint file name\n");
+		usage ();
+		exit (1);
+	    }
+	    argi++;
+	    strncpy (tf_ckp_name, argv[argi], NAME_LEN-1);
+	    tf_ckp_name[NAME_LEN-1] = '\0';
+	} else
 	if (strcmp(argv[argi], "-upr") == 0) {
 	    use_proof_res = 1;
 	    argi++;
@@ -322,7 +922,24 @@ int main (int argc, char **argv) {
     mpz_mul_2exp (Fm1, Fm1, exp);	// "
     mpz_add_ui (F, Fm1, 1L);		// F = Fm1 + 1
 
-    // Parse the known factors and do some sanity checks
+    // Check the bases. Pepin's test needs each base to be a quadratic non-residue mod F, as 3, 5 and 7 are for F2 and above.
+    proof_base = -1;
+    for (i = 0; i < n_base; i++) {
+	mpz_set_ui (tmp, bases[i]);
+	if (bases[i] < 2 || mpz_jacobi (tmp, F) != -1) {
+	    printf ("Error: base %lu is not a quadratic non-residue mod F%d, so cannot be used for Pepin's test\n", bases[i], n);
+	    exit (1);
+	}
+	for (j = 0; j < i; j++) {
+	    if (bases[i] == bases[j]) {
+		printf ("Error: base is a duplicate: %lu\n", bases[i]);
+		exit (1);
+	    }
+	}
+	if (bases[i] == 3) proof_base = i;
+    }
+
+    // Parse the known factors
     n_fact = argc - argi;
     if (n_fact > N_FACT) {
 	printf ("Error: cofact currently supports a maximum of %d factors; %d factors supplied\n", N_FACT, n_fact);
@@ -333,37 +950,23 @@ int main (int argc, char **argv) {
 	    printf ("Error: cannot parse factor: %s\n", argv[argi]);
 	    exit (1);
 	}
-	// Check that the known factor is not <= one
-	if (mpz_cmp_ui (fact[i], 1L) <= 0) {
-	    printf ("Error: supplied factor is <= 1: %s\n", argv[argi]);
-	    printf ("Supplied factors must be primes that divide the Fermat number and must not be duplicated in the list\n");
-	    exit (1);
-	}
-	// Check that the known factor divides the Fermat number
-	mpz_tdiv_r (tmp, F, fact[i]);		// tmp = F mod fact[i]
-	if (mpz_cmp_ui (tmp, 0L) != 0) {
-	    printf ("Error: supplied factor does not divide F%d: %s\n", n, argv[argi]);
-	    printf ("Supplied factors must be primes that divide the Fermat number and must not be duplicated in the list\n");
-	    exit (1);
-	}
-	// Check that the known factor is a pseudo prime using Fermat's little theorem
-	mpz_set_ui (Base, 3L);
-	mpz_sub_ui (Exp, fact[i], 1L);
-	mpz_powm (R, Base, Exp, fact[i]);
-	if (mpz_cmp_ui (R, 1) != 0) {
-	    printf ("Error: supplied factor is composite: %s\n", argv[argi]);
-	    printf ("Supplied factors must be primes that divide the Fermat number and must not be duplicated in the list\n");
+	argi++;
+    }
+
+    // Check the supplied factors and the trial factoring range before any long calculation
+    n_supplied = n_fact;
+    check_factors (fact, 0, n_fact, F, n);
+
+    if (tf_ckp_name[0] != '\0' && !tf_enabled) {
+	printf ("Error: -tfc requires -tf\n");
+	exit (1);
+    }
+    if (tf_enabled) {
+	if (tf_k_min < 1 || tf_k_max < tf_k_min || tf_k_max > ((1UL << TF_Q_BITS) - 2) >> (n + 2)) {
+	    printf ("Error: trial factoring range must satisfy 1 <= k_min <= k_max < 2^%d / 2^%d\n", TF_Q_BITS, n + 2);
 	    exit (1);
 	}
-	// Check that the known factor is not a duplicate
-	for (j = 0; j < i; j++) {
-	    if (mpz_cmp (fact[i], fact[j]) == 0) {
-		printf ("Error: supplied factor is a duplicate: %s\n", argv[argi]);
-		printf ("Supplied factors must be primes that divide the Fermat number and must not be duplicated in the list\n");
-		exit (1);
-	    }
-	}
-	argi++;
+	if (threads < 1) threads = 1;
     }
 
     // If checking or using a proof file residue is enabled, read the proof file
@@ -371,8 +974,13 @@ int main (int argc, char **argv) {
     	printf ("Error: Can only specify one of -cpr and -upr\n");
 	exit (1);
     }
+    if ((check_proof_res || use_proof_res) && proof_base < 0) {
+	printf ("Error: The proof file A residue is for base 3, so -cpr and -upr require base 3 in the -b list\n");
+	exit (1);
+    }
 
     if (check_proof_res || use_proof_res) {
+	(void) gettimeofday(&tv_stage, (struct timezone *) 0);
     	printf ("Reading residue from proof file: %s\n", proof_file_name);
 
 	if ((fp_proof = fopen (proof_file_name, "rb")) == NULL) {			// The "b" is not needed according to fopen man page
@@ -458,147 +1066,148 @@ int main (int argc, char **argv) {
 	free (A_proof_raw);
 
 //	print_mpz (A_proof, 16, "A_proof");
+	if (stage_times) print_stage_time ("proof", &tv_stage);
 	printf ("\n");
     }
 
-    // If "use proof residue" enabled, skip the A calc steps; othwise perform them
-    if (use_proof_res) {
-    	printf ("Using A residue from proof file instead of calculating it\n");
-    	mpz_set (A, A_proof);
-
-    	printf ("Skipping the Pepin test\n\n");
-	fermat_prime = 0;					// If skipping the Pepin test, assume the Fermat number is composite
-    } else {
-    	// If not using proof file residue, do the full Pepin and Suyama calculations
-	printf ("Testing F%d for primality using the Pepin test\n", n);
-	if (verbose) printf ("Using %d threads in gwnum library\n", threads);
-	fflush (stdout);
-
-	k = 1;							// K for modulo value
-
-	if (debug) printf ("Calling gwinit (gwhandle = %p)\n", &gwdata); 
-	gwinit (&gwdata);					// Initialize the gwnum handle
-
-	if (debug) printf ("Calling gwset_num_threads (gwhandle = %p, num_threads = %ld)\n", &gwdata, (unsigned long) threads); 
-	gwset_num_threads (&gwdata, (unsigned long) threads);	// Set number of threads to use
-
-	if (debug) printf ("Calling gwset_safety_margin (gwhandle = %p, safety_margin = %lf)\n", &gwdata, (double) 2.0); 
-	gwset_safety_margin (&gwdata, (double) 2.0);		// Had to set this to 3 in pmfs to prevent calc errors with very large N
+    // If trial factoring is enabled, add any new factors found to the supplied factors, then check them too
+    if (tf_enabled) {
+	(void) gettimeofday(&tv_stage, (struct timezone *) 0);
+	tf_n_found = trial_factor (n, F, tf_k_min, tf_k_max, threads, tf_ckp_name, tf_found, verbose);
+	for (i = 0; i < tf_n_found; i++) {
+	    mpz_set_ui (tmp, tf_found[i]);			// tmp = k * 2^(n+2) + 1
+	    mpz_mul_2exp (tmp, tmp, n + 2);
+	    mpz_add_ui (tmp, tmp, 1L);
+
+	    for (j = 0; j < n_fact; j++) {
+		if (mpz_cmp (tmp, fact[j]) == 0) break;
+	    }
+	    if (j < n_fact) {
+		printf ("Trial factoring factor was already supplied: ");
+		mpz_out_str (stdout, 10, tmp);
+		printf ("\n");
+		continue;
+	    }
 
-	if (debug) printf ("Calling gwsetup (gwhandle = %p, k = %lf, b = %ld, n = %ld, c = %ld)\n", &gwdata, (double) k, 2L, exp, 1L); 
-	gwerr = gwsetup (&gwdata, (double) k, 2L, exp, 1L);	// Setup to use modulo F = 2^2^n + 1
-								// Note that K is double, so only values <= 53 bits can be represented. GWNUM checks for this.
-	if (gwerr) {
-	    if (gwerr == 1002) {
-		printf ("gwsetup error = 1002 (Number too large for the FFTs)\n");
-		if (n == 30) printf ("Note that gwnum requires an AVX512 computer to support F30\n");
-	    } else {
-		printf ("gwsetup error = %d\n", gwerr);
+	    if (n_fact == N_FACT) {
+		printf ("Error: cofact currently supports a maximum of %d factors\n", N_FACT);
+		exit (1);
 	    }
-	    exit (1);
-	}
-	gwsetnormroutine (&gwdata, 0, 1, 0);			// Set flag to enable round-off error checking
-								// This call must be AFTER gwsetup
-	if (verbose) {
-	    gwfft_description (&gwdata, line);
-	    printf ("fft_description: %s\n", line);
-	    printf ("fftlen = %ld\n", gwfftlen (&gwdata));
-	    printf ("near_fft_limit = %d\n", gwnear_fft_limit (&gwdata, (double)3.0));
+	    printf ("Adding trial factoring factor to the known factors: ");
+	    mpz_out_str (stdout, 10, tmp);
 	    printf ("\n");
+	    mpz_set (fact[n_fact++], tmp);
 	}
+	if (tf_n_found > 0) printf ("\n");
+	check_factors (fact, n_supplied, n_fact, F, n);
+	if (stage_times) print_stage_time ("tf", &tv_stage);
+    }
 
-	r_gw = gwalloc (&gwdata);				// Allocate a GW number for the residue
-	if (r_gw == NULL) {
-	    printf ("gwalloc for r_gw failed\n");
-	    exit (1);
+    // Calculate P = product of the known factors, and the cofactor C = F / P
+    mpz_set_ui (P, 1L);
+    for (i = 0; i < n_fact; i++) {
+	mpz_mul (P, P, fact[i]);
+    }
+    mpz_sub_ui (Pm1, P, 1L);
+    mpz_div (C, F, P);
+    fully_factored = (mpz_cmp_ui (C, 1L) == 0);
+
+    // Set up one test per base. The bases share the factors, the cofactor and the proof file residue.
+    for (i = 0; i < n_base; i++) {
+	bt[i].base = bases[i];
+	if (n_base > 1) {
+	    snprintf (bt[i].label, sizeof (bt[i].label), "Base %lu ", bases[i]);
+	} else {
+	    bt[i].label[0] = '\0';
 	}
+	bt[i].n = n;
+	bt[i].verbose = verbose;
+	bt[i].debug = debug;
+	bt[i].tv_start = &tv_start;
+	bt[i].F = F;
+	bt[i].Pm1 = Pm1;
+	mpz_init (bt[i].R);
+	mpz_init (bt[i].A);
+	mpz_init (bt[i].B);
+    }
 
-	// Initialize r_gw = base for Pepin test = 3
-	base = 3;
-	binary64togw (&gwdata, &base, 1L, r_gw);		
-
-	gw_clear_maxerr (&gwdata);
-
-	// Create buffer for transfer of residues from GWNUM to GMP
-	r_bin_buf_len = exp / 64 + 1;
-	r_bin = (unsigned long *) calloc (r_bin_buf_len, sizeof (unsigned long));
-/*
-	len = gwtobinary64 (&gwdata, r_gw, r_bin, r_bin_buf_len);
-	printf ("base = %2ld, r_gw = %016lx %016lx\n", base, r_bin[1], r_bin[0]);
-*/
-	x = exp - 1;						// Number of Pepin test square/mod steps: x = 2^n - 1
-
-	// If the progress print increment has not been set and the test is likely to take more than a second (at least 100000 steps), set it by default to 10% of the run
-	if (m_progress_inc == 0 && x > 100000) m_progress_inc = x / 10;
-
-	m_progress = m_progress_inc;
-	(void) gettimeofday(&tv_progress_start, (struct timezone *) 0);
+    // If "use proof residue" enabled, skip the A calc steps for base 3; othwise perform them
+    n_chain = n_base;
+    if (use_proof_res) {
+	if (n_base > 1) {
+	    printf ("Using base 3 A residue from proof file instead of calculating it\n");
+	} else {
+	    printf ("Using A residue from proof file instead of calculating it\n");
+	}
+	mpz_set (bt[proof_base].A, A_proof);
+	n_chain--;
+    }
 
-	// Almost all the runtime is in the following loop
-	for (m = 1; m <= x; m++) {
-	    if (m < 24) {						// FIXME Good for n <= 2^24? Could this be set more intelligently?
-		gwsquare2_carefully (&gwdata, r_gw, r_gw);		// r_gw = (r_gw ^ 2) mod F
-	    } else {
-		gwsquare2 (&gwdata, r_gw, r_gw, 0);			// r_gw = (r_gw ^ 2) mod F
+    fermat_prime = 0;
+    cofactor_prp = 0;
+    if (n_chain == 0) {
+    	printf ("Skipping the Pepin test\n\n");			// If skipping the Pepin test, assume the Fermat number is composite
+    } else {
+    	// If not using proof file residue, do the full Pepin and Suyama calculations, with one gwnum chain per base
+	(void) gettimeofday(&tv_stage, (struct timezone *) 0);
+	if (n_base > 1) {
+	    printf ("Testing F%d for primality using the Pepin test with bases", n);
+	    for (i = 0; i < n_base; i++) {
+		if (!(use_proof_res && i == proof_base)) printf (" %lu", bases[i]);
 	    }
+	    printf ("\n");
+	} else {
+	    printf ("Testing F%d for primality using the Pepin test\n", n);
+	}
 
-	    maxerr = gw_get_maxerr (&gwdata);
-	    if (maxerr >= 0.45) {
-		printf ("Roundoff warning: k = %ld, n = %d, m = %ld, maxerr = %22.20lf\n", k, n, m, maxerr);
-		gw_clear_maxerr (&gwdata);
-	    }
+	// If the progress print increment has not been set and the test is likely to take more than a second (at least 100000 steps), set it by default to 10% of the run
+	if (m_progress_inc == 0 && exp - 1 > 100000) m_progress_inc = (exp - 1) / 10;
 
-	    if (m_progress_inc > 0 && m >= m_progress) {
-		(void) gettimeofday(&tv_progress_stop, (struct timezone *) 0);
-		wall_time = tv_secs(tv_progress_stop) - tv_secs(tv_start);
-		wall_hours = wall_time / 3600;
-		wall_mins = (wall_time - (wall_hours * 3600)) / 60;
-		wall_secs = (wall_time - (wall_hours * 3600) - (wall_mins * 60));
-		ms_per_iter = (tv_msecs(tv_progress_stop) - tv_msecs(tv_progress_start)) / m_progress_inc;
-		printf ("Iteration: %9ld / %9ld (%5.1f%%), ms/iter: %7.3lf, Wall time = %d:%02d:%02d (HH:MM:SS)\n", m, x, 100.0 * m / x, ms_per_iter, wall_hours, wall_mins, wall_secs);
-		fflush (stdout);
-		m_progress += m_progress_inc;
-		tv_progress_start.tv_sec  = tv_progress_stop.tv_sec;
-		tv_progress_start.tv_usec = tv_progress_stop.tv_usec;
+	// Split the threads between the chains, giving any remainder to the first chains. Each chain gets at least one thread.
+	if (threads < n_chain) {
+	    printf ("Warning: %d threads requested but each base uses at least one thread, so using %d threads\n\n", threads, n_chain);
+	}
+	for (i = 0, j = 0; i < n_base; i++) {
+	    if (use_proof_res && i == proof_base) continue;
+	    bt[i].threads = threads / n_chain + (j < threads % n_chain ? 1 : 0);
+	    if (bt[i].threads < 1) bt[i].threads = 1;
+	    bt[i].m_progress_inc = m_progress_inc;
+	    if (pthread_create (&base_tid[i], NULL, pepin_thread, &bt[i]) != 0) {
+		printf ("Error: Unable to create Pepin test thread\n");
+		exit (1);
 	    }
+	    j++;
 	}
-
-	// Check for errors
-	gwerr =  gw_test_for_error (&gwdata);
-	if (gwerr) {
-	    printf ("Error: gw_test_for_error = %d\n", gwerr);
-	    exit (1);
+	for (i = 0; i < n_base; i++) {
+	    if (use_proof_res && i == proof_base) continue;
+	    pthread_join (base_tid[i], NULL);
 	}
 
-	// Convert Pepin residue r_gw to r_bin to R
-	len = gwtobinary64 (&gwdata, r_gw, r_bin, r_bin_buf_len);
-	mpz_import (R, len, -1, 8, 0, 0, r_bin);
-
-	if (verbose) {
-	    printf ("Pepin residue:  len = %d, %016lx ... %016lx %016lx\n", len, r_bin[len-1], r_bin[1], r_bin[0]);
+	// F is prime iff every Pepin residue is -1
+	fermat_prime = 1;
+	for (i = 0; i < n_base; i++) {
+	    if (use_proof_res && i == proof_base) continue;
+	    if (verbose) printf ("%s", bt[i].R_len_line);
+	    snprintf (line, sizeof (line), "%sPepin", bt[i].label);
+	    print_residues (bt[i].R, line);
+	    if (mpz_cmp (bt[i].R, Fm1) != 0) fermat_prime = 0;
+	    if (n_base > 1) printf ("Base %lu: F%d is %s\n", bases[i], n, mpz_cmp (bt[i].R, Fm1) == 0 ? "prime!" : "composite");
 	}
-
-	print_residues (R, "Pepin");
-
-	if (mpz_cmp (R, Fm1) == 0) {
-	    fermat_prime = 1;
+	if (fermat_prime) {
 	    printf ("F%d is prime!\n\n", n);
 	} else {
-	    fermat_prime = 0;
 	    printf ("F%d is composite\n\n", n);
 	}
 
-	// Square/mod one more time to get A. This is the mprime proof file residue.
-	gwsquare2 (&gwdata, r_gw, r_gw, 0);		// r_gw = (r_gw ^ 2) mod F
-	len = gwtobinary64 (&gwdata, r_gw, r_bin, r_bin_buf_len);
-	mpz_import (A, len, -1, 8, 0, 0, r_bin);
-
 	if (verbose) {
-	    printf ("Suyama A residue: len = %d, %016lx ... %016lx %016lx\n", len, r_bin[len-1], r_bin[1], r_bin[0]);
+	    for (i = 0; i < n_base; i++) {
+		if (use_proof_res && i == proof_base) continue;
+		printf ("%s", bt[i].A_len_line);
+	    }
 	}
 
 	if (check_proof_res) {
-	    if (mpz_cmp (A, A_proof) == 0) {
+	    if (mpz_cmp (bt[proof_base].A, A_proof) == 0) {
 		printf ("Calculated A residue matches proof file residue\n\n");
 	    } else {
 		printf ("Error: Calculated A residue does not match proof file residue\n\n");
@@ -606,12 +1215,16 @@ int main (int argc, char **argv) {
 	    }
 	}
 
-	gwfree (&gwdata, r_gw);			// Free the GW number: GW docs do not make it clear when this is needed
-	gwdone (&gwdata);			// Free all GW data
+	if (stage_times) print_stage_time ("pepin", &tv_stage);
+    }
+
+    // If the known factors are the complete factorization, there is no cofactor to test
+    if (fully_factored) {
+	printf ("F%d is completely factored by the known factors, skipping the Suyama test\n\n", n);
     }
 
     // If known factors were provided, perform the Suyama test to determine whether the remaining cofactor C is a PRP or composite
-    if (n_fact > 0) {
+    if (n_fact > 0 && !fully_factored) {
 	printf ("Testing the F%d cofactor for primality using the following known factors: ", n);
 	for (i = 0; i < n_fact; i++) {
 	    mpz_out_str (stdout, 10, fact[i]);
@@ -619,21 +1232,6 @@ int main (int argc, char **argv) {
 	}
 	printf ("\n");
 
-	// Calculate P = product of the known factors
-	mpz_set_ui (P, 1L);
-	for (i = 0; i < n_fact; i++) {
-	    mpz_mul (P, P, fact[i]);
-	}
-//	print_mpz (P, 10, "P");
-
-	// Calculate the cofactor C = F / P
-	mpz_div (C, F, P);
-/*
-	digits = mpz_sizeinbase (C, 10);
-	cof_s = malloc (digits + 2);
-	mpz_get_str (cof_s, 10, C);
-	digits = strlen (cof_s);
-*/
 	digits = num_digits (C);
 
 	if (digits < 600) {
@@ -644,50 +1242,83 @@ int main (int argc, char **argv) {
 	    printf ("Cofactor is %d digits long\n", digits);
 	}
 
-	print_residues (A, "A");
+	for (i = 0; i < n_base; i++) {
+	    snprintf (line, sizeof (line), "%sA", bt[i].label);
+	    print_residues (bt[i].A, line);
+	}
 	fflush (stdout);
 
-	// Calculate B = 3^(P-1) mod F
-	mpz_sub_ui (Pm1, P, 1L);
-	mpz_powm (B, three, Pm1, F);
-
-	print_residues (B, "B");
-
-        // Calculate R = (A - B) mod C
-	mpz_sub (R, A, B);			// R = A - B
-	mpz_mod (R, R, C);			// R = (A - B) mod C
+	// Calculate B = b^(P-1) mod F, one thread per base
+	(void) gettimeofday(&tv_stage, (struct timezone *) 0);
+	for (i = 0; i < n_base; i++) {
+	    if (pthread_create (&base_tid[i], NULL, suyama_b_thread, &bt[i]) != 0) {
+		printf ("Error: Unable to create Suyama B thread\n");
+		exit (1);
+	    }
+	}
+	for (i = 0; i < n_base; i++) {
+	    pthread_join (base_tid[i], NULL);
+	    snprintf (line, sizeof (line), "%sB", bt[i].label);
+	    print_residues (bt[i].B, line);
+	}
+	if (stage_times) print_stage_time ("suyama_b", &tv_stage);
 
-	print_residues (R, "(A-B) mod C");
+	// C is a PRP only if it is a PRP to every base
+	cofactor_prp = 1;
+	for (i = 0; i < n_base; i++) {
+	    // Calculate R = (A - B) mod C
+	    mpz_sub (bt[i].R, bt[i].A, bt[i].B);	// R = A - B
+	    mpz_mod (bt[i].R, bt[i].R, C);		// R = (A - B) mod C
 
-	if (mpz_cmp_ui (R, 0L) == 0) {
-	    cofactor_prp = 1;
-	    printf ("F%d cofactor is a probable prime!\n", n);
-	} else {
-	    cofactor_prp = 0;
+	    snprintf (line, sizeof (line), "%s(A-B) mod C", bt[i].label);
+	    print_residues (bt[i].R, line);
 
-	    // Test if the cofactor is a prime power
-	    mpz_sub (R, A, B);			// R = A - B
-	    mpz_gcd (R, R, C);			// R = GCD ((A-B), C)
-	    if (mpz_cmp_ui (R, 1L) == 0) {
-		printf ("F%d cofactor is composite and is not a prime power\n", n);
+	    if (n_base > 1) printf ("Base %lu: ", bases[i]);
+	    if (mpz_cmp_ui (bt[i].R, 0L) == 0) {
+		printf ("F%d cofactor is a probable prime!\n", n);
+	    } else {
+		cofactor_prp = 0;
+
+		// Test if the cofactor is a prime power
+		mpz_sub (bt[i].R, bt[i].A, bt[i].B);	// R = A - B
+		mpz_gcd (bt[i].R, bt[i].R, C);		// R = GCD ((A-B), C)
+		if (mpz_cmp_ui (bt[i].R, 1L) == 0) {
+		    printf ("F%d cofactor is composite and is not a prime power\n", n);
+		} else {
+		    printf ("F%d cofactor is composite and is also a prime power!\n", n);
+		    print_mpz (bt[i].R, 10, "GCD (A-B, C)");
+		}
+	    }
+	}
+	if (n_base > 1) {
+	    if (cofactor_prp) {
+		printf ("F%d cofactor is a probable prime to all %d bases!\n", n, n_base);
 	    } else {
-		printf ("F%d cofactor is composite and is also a prime power!\n", n);
-		print_mpz (R, 10, "GCD (A-B, C)");
+		printf ("F%d cofactor is composite\n", n);
 	    }
 	}
+	if (stage_times) print_stage_time ("suyama_r", &tv_stage);
 	printf ("\n");
     }
 
+    for (i = 0; i < n_base; i++) {
+	mpz_clear (bt[i].R);
+	mpz_clear (bt[i].A);
+	mpz_clear (bt[i].B);
+    }
+
     // Print the compact factorization of the Fermat number
     if (n_fact > 0) {						// Fermat number has known factors
     	printf ("Factorization: F%d = ", n);
 	for (i = 0; i < n_fact; i++) {
-	    printf ("p%d * ", num_digits (fact[i]));
+	    printf (i == 0 ? "p%d" : " * p%d", num_digits (fact[i]));
 	}
-	if (cofactor_prp) {
-	    printf ("p%d\n\n", num_digits (C));
+	if (fully_factored) {
+	    printf ("\n\n");
+	} else if (cofactor_prp) {
+	    printf (" * p%d\n\n", num_digits (C));
 	} else {
-	    printf ("c%d\n\n", num_digits (C));
+	    printf (" * c%d\n\n", num_digits (C));
 	}
     } else {							// Fermat number does not have known factors
     	if (fermat_prime) {